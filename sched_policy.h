@@ -0,0 +1,54 @@
+#ifndef SCHED_POLICY_H
+#define SCHED_POLICY_H
+
+struct Node;
+
+#define QUANTUM_SHORT 10000		/* 'S' time quantum in microseconds */
+#define QUANTUM_LONG 20000		/* 'L' time quantum in microseconds */
+#define QUANTUM_MIN 1000		/* Shortest explicit time quantum */
+#define QUANTUM_ADAPT_MIN 1000	/* Lower bound for adaptive quanta */
+#define QUANTUM_ADAPT_MAX 160000	/* Upper bound for adaptive quanta */
+
+/* Next adaptive quantum of a task that did or did not use its whole slice */
+long next_quantum(long quantum, int used_full);
+
+/* Why the running task left the CPU */
+enum SLICE_END {
+    SLICE_EXPIRED,		/* Quantum ran out, possibly deferred to hw_preempt_enable */
+    SLICE_YIELD,		/* Gave the CPU up with hw_yield */
+    SLICE_BLOCK,		/* Went to sleep */
+    SLICE_EXIT,			/* Terminated */
+    SLICE_PAUSE			/* Simulation paused; the task keeps its state */
+};
+
+/* Scheduling policy; the task queue itself belongs to the simulator, a policy
+   only decides the order in which ready tasks get the CPU */
+struct sched_policy {
+    const char *name;
+    void (*enqueue)(struct Node *node);			/* Task was added to the queue */
+    void (*dequeue)(struct Node *node);			/* Task is about to leave the queue */
+    struct Node *(*pick_next)(void);			/* Next task to run, NULL if none is ready */
+    void (*tick)(struct Node *node, long elapsed,
+                 enum SLICE_END reason);		/* Task left the CPU after elapsed us */
+    void (*wake)(struct Node *node);			/* Waiting task became ready */
+};
+
+/*
+ * Building with -DSCHED_POLICY=<name> compiles in the <name>_* policy alone
+ * and calls it directly, so there is no indirect call on the tick path;
+ * otherwise calls go through the policy chosen at startup.
+ */
+#define SCHED_CAT_(a, b) a##_##b
+#define SCHED_CAT(a, b) SCHED_CAT_(a, b)
+#define SCHED_STR_(a) #a
+#define SCHED_STR(a) SCHED_STR_(a)
+
+#ifdef SCHED_POLICY
+#define policy_op(op) SCHED_CAT(SCHED_POLICY, op)
+#define policy_name() SCHED_STR(SCHED_POLICY)
+#else
+#define policy_op(op) (policy->op)
+#define policy_name() (policy->name)
+#endif
+
+#endif
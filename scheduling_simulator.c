@@ -1,23 +1,36 @@
+#define _GNU_SOURCE	/* REG_RSP/REG_ESP in ucontext.h */
 #include "scheduling_simulator.h"
+#include "workload.h"
+#include "sched_policy.h"
 
 #define _XOPEN_SOURCE_EXTENDED 1
 
 #ifdef _LP64
-#define STACK_SIZE 2097152+16384	/* Large enough value for AMODE 64 */
+#define STACK_SIZE (2097152+16384)	/* Large enough value for AMODE 64 */
 #else
 #define STACK_SIZE 16384			/* AMODE 31 addressing */
 #endif
 
+#define TASK_STACK_INIT 8192		/* Initial size of a task stack */
+#define ALT_STACK_SIZE 65536		/* Stack of the SIGSEGV handler */
+
 /* Task queue data structure */
 struct Data {
     int pid;
     char task_name[10];
     ucontext_t context;
     enum TASK_STATE task_state;
-    int time_quantum;
-    int queueing_time;
-    int waiting_time;
+    long time_quantum;		/* Time quantum in microseconds */
+    int adaptive;			/* Quantum follows the task's behaviour */
+    long queueing_time;		/* Microseconds spent in TASK_READY */
+    long waiting_time;		/* Microseconds left in TASK_WAITING */
     char prior;
+    long run_time;			/* Microseconds spent in TASK_RUNNING */
+    int trace;				/* Index in the replayed workload, -1 otherwise */
+    char *stack;			/* Base of the reserved stack region */
+    size_t stack_size;		/* Reserved bytes, guard page included */
+    size_t stack_committed;	/* Usable bytes at the top of the region */
+    int preempt_count;		/* Saved hw_preempt_disable nesting */
 };
 
 struct Node {
@@ -37,21 +50,413 @@ static struct itimerval t;				/* Timer interval */
 
 static struct sigaction p_act;
 static struct sigaction t_act;
+static struct sigaction s_act;
+static stack_t alt_stack;				/* Stack the SIGSEGV handler runs on */
+static size_t page_size;
+static size_t task_stack_max = STACK_SIZE;	/* Cap on the size of a task stack */
 
 static struct Node* head = NULL;		/* Node pointer for head node */
 static struct Node *current_node;		/* Node pointer for current node */
 struct Node *newNode;
 static int pid_counter = 1;
 static int wait_exist = 0;
+static long long slice_start;			/* Time the running task was scheduled in */
+static int task_on_cpu;					/* A slice is open; cleared when the shell takes over */
+static long long switch_count;			/* Tasks dispatched by the scheduler */
+static long armed_quantum;				/* Period the interval timer is armed with */
+static volatile sig_atomic_t preempt_count;		/* Running task's hw_preempt_disable nesting */
+static volatile sig_atomic_t preempt_pending;	/* A tick was deferred by a critical section */
+static struct workload replay_wl;		/* Trace replayed on the real timer path */
+
+/* Monotonic clock in microseconds */
+long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Microseconds the running task has held the CPU in its current slice */
+static long slice_elapsed(void)
+{
+    return (long)(now_us() - slice_start);
+}
+
+/* Arms the interval timer with a period of usec microseconds; 0 disarms it */
+static void set_timer(long usec)
+{
+    if(usec==0&&armed_quantum==0) // Cooperative tasks never touch the timer
+        return;
+    armed_quantum = usec;
+    t.it_interval.tv_sec = usec / 1000000;
+    t.it_interval.tv_usec = usec % 1000000;
+    t.it_value = t.it_interval;
+    if (setitimer(ITIMER_REAL, &t, NULL) < 0) {
+        printf("settimer error.\n");
+        exit(1);
+    }
+}
+
+/* Adaptive quantum; halves it for tasks that block before the timer fires
+  (interactive) and doubles it for tasks that use the whole slice (CPU bound).
+  The trace simulator applies the same rule */
+long next_quantum(long quantum, int used_full)
+{
+    if(used_full)
+        return quantum*2 > QUANTUM_ADAPT_MAX ? QUANTUM_ADAPT_MAX : quantum*2;
+    return quantum/2 < QUANTUM_ADAPT_MIN ? QUANTUM_ADAPT_MIN : quantum/2;
+}
+
+static void adapt_quantum(struct Node *node, int used_full)
+{
+    if(node->data.adaptive)
+        node->data.time_quantum = next_quantum(node->data.time_quantum, used_full);
+}
+
+/* Round-robin policy; the task queue is the run order and current_node is the
+  cursor, so a preempted task goes behind every other task in the queue */
+static inline void rr_enqueue(struct Node *node)
+{
+    if(current_node==NULL)
+        current_node = node;
+}
 
+static inline void rr_dequeue(struct Node *node)
+{
+    if(current_node!=node)
+        return;
+    if(node->next!=NULL)
+        current_node = node->next;
+    else if(head!=node)
+        current_node = head;
+    else
+        current_node = NULL;
+}
+
+static inline struct Node *rr_pick_next(void)
+{
+    if(current_node==NULL)
+        current_node = head;
+    struct Node *original_node = current_node;
+    while (current_node->data.task_state != TASK_READY
+            &&current_node->data.task_state !=TASK_RUNNING) {
+        if(current_node->next==NULL) {
+            current_node = head;
+        } else {
+            current_node = current_node->next;
+        }
+        if(original_node==current_node) {
+            return NULL;
+        }
+    }
+    return current_node;
+}
 
+static inline void rr_tick(struct Node *node, long elapsed, enum SLICE_END reason)
+{
+    switch(reason) {
+    case SLICE_EXPIRED:
+        adapt_quantum(node, 1);
+        current_node = node->next!=NULL ? node->next : head;
+        break;
+    case SLICE_YIELD: // Gave the CPU up early, like a block
+        adapt_quantum(node, 0);
+        current_node = node->next!=NULL ? node->next : head;
+        break;
+    case SLICE_BLOCK:
+        adapt_quantum(node, 0);
+        break;
+    default:
+        break;
+    }
+}
 
-int main()
+static inline void rr_wake(struct Node *node)
 {
+    /* The cursor reaches every ready task in turn */
+}
+
+#ifndef SCHED_POLICY
+static const struct sched_policy policies[] = {
+    { "rr", rr_enqueue, rr_dequeue, rr_pick_next, rr_tick, rr_wake },
+};
+static const struct sched_policy *policy = &policies[0];
+#endif
+
+/* Selects the scheduling policy by name; returns -1 if there is no such policy */
+static int select_policy(const char *name)
+{
+#ifdef SCHED_POLICY
+    return strcmp(name, policy_name())==0 ? 0 : -1;
+#else
+    for (int i = 0; i < sizeof(policies) / sizeof(policies[0]); i++) {
+        if(strcmp(name, policies[i].name)==0) {
+            policy = &policies[i];
+            return 0;
+        }
+    }
+    return -1;
+#endif
+}
+
+/* Ends the running task's slice for the given reason; moves it to the matching
+  state, charges the elapsed time to the queueing and sleeping tasks and lets
+  the policy account the slice */
+static void end_slice(enum SLICE_END reason)
+{
+    long elapsed = slice_elapsed();
+    struct Node *current = head;
+
+    task_on_cpu = 0;
+    current_node->data.run_time += elapsed;
+    if(reason==SLICE_EXPIRED||reason==SLICE_YIELD) {
+        current_node->data.task_state = TASK_READY;
+    } else if(reason==SLICE_BLOCK) {
+        current_node->data.task_state = TASK_WAITING;
+    } else if(reason==SLICE_EXIT) {
+        current_node->data.task_state = TASK_TERMINATED;
+    }
+    current_node->data.preempt_count = preempt_count;
+    preempt_count = 0;
+    preempt_pending = 0;
+    while (current!=NULL) {
+        if(current!=current_node&&current->data.task_state == TASK_READY) {
+            current->data.queueing_time += elapsed;
+        }
+        if(current!=current_node&&current->data.task_state == TASK_WAITING) {
+            current->data.waiting_time -= elapsed;
+            if(current->data.waiting_time <= 0) {
+                current->data.waiting_time = 0;
+                current->data.task_state = TASK_READY;
+                policy_op(wake)(current);
+            }
+        }
+        current = current->next;
+    }
+    policy_op(tick)(current_node, elapsed, reason);
+}
+
+/* Discards a tick left pending, with SIGALRM blocked, by the slice that just
+  ended; the new slice has its own timer */
+static void drop_stale_tick(void)
+{
+    sigset_t pending, alarm;
+    int sig;
+    sigemptyset(&alarm);
+    sigaddset(&alarm, SIGALRM);
+    sigpending(&pending);
+    if(sigismember(&pending, SIGALRM))
+        sigwait(&alarm, &sig);
+}
+
+/* Makes next the running task and starts its slice; the caller switches to it */
+static void dispatch(struct Node *next)
+{
+    current_node = next;
+    preempt_count = current_node->data.preempt_count;
+    set_timer(current_node->data.time_quantum);
+    //printf("Schedule in task's PID\t:\t%d\n", current_node->data.pid);
+    current_node->data.task_state = TASK_RUNNING;
+    switch_count++;
+    slice_start = now_us();
+    task_on_cpu = 1;
+}
+
+/* Makes a fresh scheduler function context to switch to */
+static void make_scheduler_context(void)
+{
+    getcontext(&scheduler_context);
+    sigemptyset(&scheduler_context.uc_sigmask); // Not whatever mask the caller had
+    sigaddset(&scheduler_context.uc_sigmask, SIGALRM); // but no tick before the switch
+    scheduler_context.uc_stack.ss_sp = scheduler_stack;
+    scheduler_context.uc_stack.ss_size = STACK_SIZE;
+    scheduler_context.uc_stack.ss_flags = 0;
+    scheduler_context.uc_link = &mcontext;
+    makecontext(&scheduler_context, scheduler, 0);
+}
+
+
+/* Reserves task_stack_max bytes plus a guard page for a task stack and commits
+  only the top TASK_STACK_INIT bytes; the rest is committed on faults */
+static char *stack_create(size_t *size)
+{
+    *size = (task_stack_max + page_size - 1) / page_size * page_size + page_size;
+    char *stack = mmap(NULL, *size, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    if (mprotect(stack + *size - TASK_STACK_INIT, TASK_STACK_INIT,
+                 PROT_READ | PROT_WRITE) < 0) {
+        perror("mprotect");
+        exit(1);
+    }
+    return stack;
+}
+
+static void stack_destroy(struct Node *node)
+{
+    char here;
+    /* A handler running on the stack being removed (pause while idling) leaks it */
+    if (&here >= node->data.stack && &here < node->data.stack + node->data.stack_size)
+        return;
+    munmap(node->data.stack, node->data.stack_size);
+}
+
+/* Deepest stack use so far; mmap hands out zeroed pages, so the lowest
+  non-zero byte of the committed part is the high-water mark */
+static size_t stack_high_water(struct Node *node)
+{
+    char *top = node->data.stack + node->data.stack_size;
+    char *p = top - node->data.stack_committed;
+    while (p < top && *p == 0)
+        p++;
+    return top - p;
+}
+
+/* Stack pointer of the code a signal interrupted, NULL where unknown */
+static char *fault_sp(void *ctx)
+{
+    ucontext_t *uc = ctx;
+#if defined(__x86_64__)
+    return (char *)uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__i386__)
+    return (char *)uc->uc_mcontext.gregs[REG_ESP];
+#elif defined(__aarch64__)
+    return (char *)uc->uc_mcontext.sp;
+#else
+    (void)uc;
+    return NULL;
+#endif
+}
+
+/* Stack fault handler, runs on the alternate stack; commits more of the
+  faulting task's stack region, doubling it until the fault address and some
+  headroom fit, or terminates the task once it would pass task_stack_max */
+static void segv_handler(int sig, siginfo_t *info, void *ctx)
+{
+    char *addr = info->si_addr;
+    struct Node *node = head;
+    while (node!=NULL&&(addr<node->data.stack
+                        ||addr>=node->data.stack+node->data.stack_size)) {
+        node = node->next;
+    }
+    /* The kernel could not push a signal frame onto the running task's stack;
+      any other SI_KERNEL fault (e.g. a general protection fault) is a real bug */
+    char *sp = fault_sp(ctx);
+    if(node==NULL&&info->si_code==SI_KERNEL&&current_node!=NULL&&sp!=NULL) {
+        char *limit = current_node->data.stack + current_node->data.stack_size
+                      - current_node->data.stack_committed;
+        if(sp>=current_node->data.stack&&sp<limit+TASK_STACK_INIT) {
+            node = current_node;
+            addr = (sp<limit ? sp : limit) - 1;
+        }
+    }
+    if(node==NULL) { // Not a stack fault; let it kill us
+        signal(SIGSEGV, SIG_DFL);
+        return;
+    }
+
+    char *top = node->data.stack + node->data.stack_size;
+    size_t usable = node->data.stack_size - page_size;
+    size_t need = top - addr + TASK_STACK_INIT;
+    size_t committed = node->data.stack_committed;
+    if((size_t)(top - addr) > usable) {
+        fprintf(stderr, "\nTask %d (%s) overflowed its %zu KB stack, terminated.\n",
+                node->data.pid, node->data.task_name, task_stack_max / 1024);
+        setcontext(&terminator_context);
+    }
+    while (committed < need)
+        committed *= 2;
+    if(committed > usable)
+        committed = usable;
+    if(mprotect(top - committed, committed, PROT_READ | PROT_WRITE) < 0) {
+        perror("mprotect");
+        exit(1);
+    }
+    node->data.stack_committed = committed;
+}
+
+/* Parses a time quantum; L, S, A (adaptive), C (cooperative, never preempted)
+  or an explicit quantum of at least QUANTUM_MIN microseconds, S when empty;
+  returns -1 for anything else */
+static int parse_quantum(char *spec, long *quantum, int *adaptive)
+{
+    char *end;
+    *adaptive=0;
+    if(strcmp(spec,"C")==0) {
+        *quantum=0;
+    } else if(strcmp(spec,"L")==0) {
+        *quantum=QUANTUM_LONG;
+    } else if (strcmp(spec,"S")==0) {
+        *quantum=QUANTUM_SHORT;
+    } else if (strcmp(spec,"A")==0) {
+        *quantum=QUANTUM_SHORT;
+        *adaptive=1;
+    } else if (spec[0]=='\0') {
+        *quantum=QUANTUM_SHORT;
+    } else {
+        *quantum=strtol(spec,&end,10);
+        if(*end!='\0'||*quantum<QUANTUM_MIN)
+            return -1;
+    }
+    return 0;
+}
+
+static int create_task(char *task_name, void (*func)(void), int pid, int trace);
+static void replay(char *path, char *mode, char *quantum_spec);
+
+int main(int argc, char *argv[])
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "p:s:")) != -1) {
+        if(opt=='p'&&select_policy(optarg)==0)
+            continue;
+        if(opt=='s'&&atol(optarg)*1024>=TASK_STACK_INIT) {
+            task_stack_max = atol(optarg) * 1024;
+            continue;
+        }
+        fprintf(stderr, "usage: %s [-p policy] [-s stack_cap_kb]\n", argv[0]);
+        exit(1);
+    }
+    page_size = sysconf(_SC_PAGESIZE);
+
+    /* Activate the stack fault handler on its own stack */
+    alt_stack.ss_sp = malloc(ALT_STACK_SIZE);
+    if (alt_stack.ss_sp == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    alt_stack.ss_size = ALT_STACK_SIZE;
+    alt_stack.ss_flags = 0;
+    if (sigaltstack(&alt_stack, NULL) == -1) {
+        perror("sigaltstack");
+        exit(1);
+    }
+    s_act.sa_sigaction = &segv_handler;
+    s_act.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigfillset(&s_act.sa_mask);
+    if (sigaction(SIGSEGV, &s_act, NULL) == -1) { // Intercept SIGSEGV
+        perror("Error: cannot handle SIGSEGV");
+        exit(1);
+    }
+
+    /* Activate the timer handler */
+    t_act.sa_handler = &timer_handler;
+    t_act.sa_flags = SA_RESTART | SA_SIGINFO;
+    sigfillset(&t_act.sa_mask);
+    sigdelset(&t_act.sa_mask, SIGSEGV); // The handler may grow the task stack
+    if (sigaction(SIGALRM, &t_act, NULL) == -1) { // Intercept SIGALRM
+        perror("Error: cannot handle SIGALRM");
+        exit(1);
+    }
+
     /* Activate the pause handler */
     p_act.sa_handler = &pause_handler;
     p_act.sa_flags = SA_RESTART | SA_SIGINFO;
     sigfillset(&p_act.sa_mask);  // Block every signal during the handler
+    sigdelset(&p_act.sa_mask, SIGSEGV); // but stack faults
     if (sigaction(SIGTSTP, &p_act, NULL) == -1) { // Intercept SIGTSTP
         perror("Error: cannot handle SIGTSTP");
         exit(1);
@@ -83,12 +488,7 @@ int main()
         getcontext(&mcontext);
 
         /* Make the scheduler function context for the fist time */
-        getcontext(&scheduler_context);
-        scheduler_context.uc_stack.ss_sp = scheduler_stack;
-        scheduler_context.uc_stack.ss_size = STACK_SIZE;
-        scheduler_context.uc_stack.ss_flags = 0;
-        scheduler_context.uc_link = &mcontext;
-        makecontext(&scheduler_context, scheduler, 0);
+        make_scheduler_context();
 
         /* Make the terminator function context for the fist time */
         getcontext(&terminator_context);
@@ -101,29 +501,26 @@ int main()
 
         printf("$ ");
         char buf[512];
-        fgets(buf,512,stdin);
+        if(fgets(buf,512,stdin)==NULL)
+            break;
         if(strcmp(buf,"\n")==0)
             ;
-        char command[100], TASK_NAME[100],t[100],TIME_QUANTUM[100],p[100],PRIOR[100];
+        char command[100], TASK_NAME[100],t[100],TIME_QUANTUM[100]="",p[100],PRIOR[100]="";
         int pid;
-        int quantum;
+        long quantum;
+        int adaptive;
         sscanf(buf,"%s",command);
         if(strcmp(command,"add")==0) {
             sscanf(buf,"%s %s %s %s %s %s",command, TASK_NAME, t, TIME_QUANTUM, p, PRIOR);
-            if(TASK_NAME!=NULL) {
-                if(strcmp(TIME_QUANTUM,"L")==0) {
-                    quantum=20;
-                } else if (strcmp(TIME_QUANTUM,"S")==0) {
-                    quantum=10;
-                } else {
-                    quantum=10;
-                }
+            if(parse_quantum(TIME_QUANTUM,&quantum,&adaptive)<0) {
+                printf("time quantum should be L, S, A, C or at least %d us!\n", QUANTUM_MIN);
+            } else if(TASK_NAME!=NULL) {
                 if(strcmp(PRIOR,"H")==0) {
-                    add_task(TASK_NAME,quantum,'H');
+                    add_task(TASK_NAME,quantum,adaptive,'H');
                 } else if(strcmp(PRIOR,"L")==0) {
-                    add_task(TASK_NAME,quantum,'L');
+                    add_task(TASK_NAME,quantum,adaptive,'L');
                 } else {
-                    add_task(TASK_NAME,quantum,'L');
+                    add_task(TASK_NAME,quantum,adaptive,'L');
                 }
             } else {
                 printf("the task name should be entered!\n");
@@ -138,95 +535,56 @@ int main()
             swapcontext(&mcontext, &scheduler_context);
         } else if(strcmp(command,"ps")==0) {
             process_status();
+        } else if(strcmp(command,"replay")==0) {
+            char path[256]="", mode[16]="sim";
+            sscanf(buf,"%s %255s %15s %99s",command,path,mode,TIME_QUANTUM);
+            replay(path,mode,TIME_QUANTUM);
+        } else if(strcmp(command,"gen")==0) {
+            char path[256]="";
+            int ntasks=0;
+            long mean=WL_GEN_INTERARRIVAL;
+            unsigned int seed=1;
+            sscanf(buf,"%s %255s %d %ld %u",command,path,&ntasks,&mean,&seed);
+            if(ntasks<=0||mean<=0) {
+                printf("usage: gen <file> <ntasks> [mean_interarrival_us] [seed]\n");
+            } else if(wl_generate(path,ntasks,mean,seed)==0) {
+                printf("%d tasks written to %s\n",ntasks,path);
+            }
         } else printf("Command is unvailable\n");
     }
     free_all();
     free(signal_stack);
     free(scheduler_stack);
     free(terminator_stack);
+    free(alt_stack.ss_sp);
     return 0;
 }
-/* The RR scheduling algorithm; selects the next ready task to run and swaps to it's context to start it; if the task terminates, it will swap back and the scheduler will reschedule */
+/* The scheduler; asks the policy for the next ready task and swaps to it's context to start it; if the task terminates, it will swap back and the scheduler will reschedule */
 void scheduler(void)
 {
-    t.it_interval.tv_sec = 0;
-    t.it_interval.tv_usec = 0;
-    t.it_value = t.it_interval;
-    if (setitimer(ITIMER_REAL, &t, NULL) < 0) {
-        printf("settimer error.\n");
-        exit(1);
-    }
-    t_act.sa_handler = &timer_handler;
-    t_act.sa_flags = SA_RESTART | SA_SIGINFO;
-    sigfillset(&t_act.sa_mask);
-    if (sigaction(SIGALRM, &t_act, NULL) == -1) { // Intercept SIGALRM
-        perror("Error: cannot handle SIGALRM");
-        exit(1);
-    }
+    set_timer(0);
 
-    if(current_node==NULL) { // No task
+    if(head==NULL) { // No task
         printf("No task in the queue.\n");
         return;
     }
-    int wait = 0, terminate = 1;
-    struct Node *original_node = current_node;
-    while (current_node->data.task_state != TASK_READY
-            &&current_node->data.task_state !=TASK_RUNNING) {
-        if(current_node->data.task_state != TASK_TERMINATED) {
-            terminate = 0;
+    struct Node *next = policy_op(pick_next)();
+    if(next==NULL) {
+        struct Node *current = head;
+        while (current!=NULL&&current->data.task_state!=TASK_WAITING) {
+            current = current->next;
         }
-        if(current_node->next==NULL) {
-            current_node = head;
-        } else {
-            current_node = current_node->next;
-        }
-        if(original_node==current_node) {
-            if(terminate) {
-                t.it_interval.tv_sec = 0;
-                t.it_interval.tv_usec = 0;
-                t.it_value = t.it_interval;
-                if (setitimer(ITIMER_REAL, &t, NULL) < 0) {
-                    printf("settimer error.\n");
-                    exit(1);
-                }
-                t_act.sa_handler = &timer_handler;
-                t_act.sa_flags = SA_RESTART | SA_SIGINFO;
-                sigfillset(&t_act.sa_mask);
-                printf("All tasks were terminated.\n");
-                return;
-            } else if(current_node->data.task_state == TASK_WAITING) {
-                wait = 1;
-                break;
-            }
+        if(current==NULL) {
+            printf("All tasks were terminated.\n");
+            return;
         }
-    }
-
-    t.it_interval.tv_sec = 0;
-    t.it_interval.tv_usec = current_node->data.time_quantum * 1000;
-    t.it_value = t.it_interval;
-    if (setitimer(ITIMER_REAL, &t, NULL) < 0) {
-        printf("settimer error.\n");
-        exit(1);
-    }
-    t_act.sa_handler = &timer_handler;
-    t_act.sa_flags = SA_RESTART | SA_SIGINFO;
-    sigfillset(&t_act.sa_mask);
-    if (sigaction(SIGALRM, &t_act, NULL) == -1) { // Intercept SIGALRM
-        perror("Error: cannot handle SIGALRM");
-        exit(1);
-    }
-    if (wait) {
+        /* Nothing ready, some task is waiting; idle until it wakes up */
         wait_exist = 1;
-        add_task("waiting", 10,'L');
-        wait = 0;
-        if(current_node->next==NULL) {
-            current_node = head;
-        } else {
-            current_node = current_node->next;
-        }
+        add_task("waiting", QUANTUM_SHORT, 0, 'L');
+        next = policy_op(pick_next)();
     }
-    //printf("Schedule in task's PID\t:\t%d\n", current_node->data.pid);
-    current_node->data.task_state = TASK_RUNNING;
+    drop_stale_tick();
+    dispatch(next);
     swapcontext(&scheduler_context, &current_node->data.context);
 }
 void waiting(void)
@@ -237,47 +595,14 @@ void waiting(void)
 }
 void terminator(void)
 {
-    t.it_interval.tv_sec = 0;
-    t.it_interval.tv_usec = 0;
-    t.it_value = t.it_interval;
-    if (setitimer(ITIMER_REAL, &t, NULL) < 0) {
-        printf("settimer error.\n");
-        exit(1);
-    }
-    t_act.sa_handler = &timer_handler;
-    t_act.sa_flags = SA_RESTART | SA_SIGINFO;
-    sigfillset(&t_act.sa_mask);
-    if (sigaction(SIGALRM, &t_act, NULL) == -1) { // Intercept SIGALRM
-        perror("Error: cannot handle SIGALRM");
-        exit(1);
-    }
+    set_timer(0);
+    //printf("Terminated task's PID\t:\t%d\n", current_node->data.pid);
+    end_slice(SLICE_EXIT);
     if(wait_exist) {
         remove_task(0);
         wait_exist = 0;
     }
-    struct Node *current = head;
-    while (current!=NULL) {
-        if(current!=current_node&&current->data.task_state == TASK_READY) {
-            current->data.queueing_time += current_node->data.time_quantum;
-        }
-        if(current->data.task_state == TASK_WAITING
-                && current->data.waiting_time > 0) {
-            current->data.waiting_time -= current_node->data.time_quantum;
-        }
-        if(current->data.task_state == TASK_WAITING
-                && current->data.waiting_time == 0) {
-            current->data.task_state = TASK_READY;
-        }
-        current = current->next;
-    }
-    //printf("Terminated task's PID\t:\t%d\n", current_node->data.pid);
-    current_node->data.task_state=TASK_TERMINATED;
-    getcontext(&scheduler_context);
-    scheduler_context.uc_stack.ss_sp = scheduler_stack;
-    scheduler_context.uc_stack.ss_size = STACK_SIZE;
-    scheduler_context.uc_stack.ss_flags = 0;
-    scheduler_context.uc_link = &mcontext;
-    makecontext(&scheduler_context, scheduler, 0);
+    make_scheduler_context();
     setcontext(&scheduler_context);
 }
 
@@ -285,57 +610,28 @@ void terminator(void)
   makes and sets to new scheduler context to run the scheduler in */
 void signal_function(void)
 {
-    t.it_interval.tv_sec = 0;
-    t.it_interval.tv_usec = 0;
-    t.it_value = t.it_interval;
-    if (setitimer(ITIMER_REAL, &t, NULL) < 0) {
-        printf("settimer error.\n");
-        exit(1);
-    }
-    t_act.sa_handler = &timer_handler;
-    t_act.sa_flags = SA_RESTART | SA_SIGINFO;
-    sigfillset(&t_act.sa_mask);
-    if (sigaction(SIGALRM, &t_act, NULL) == -1) { // Intercept SIGALRM
-        perror("Error: cannot handle SIGALRM");
-        exit(1);
-    }
-
-    struct Node *current = head;
-    while (current!=NULL) {
-        if(current!=current_node&&current->data.task_state == TASK_READY) {
-            current->data.queueing_time += current_node->data.time_quantum;
-        }
-        if(current->data.task_state == TASK_WAITING
-                && current->data.waiting_time > 0) {
-            current->data.waiting_time -= current_node->data.time_quantum;
-        }
-        if(current->data.task_state == TASK_WAITING
-                && current->data.waiting_time == 0) {
-            current->data.task_state = TASK_READY;
-        }
-        current = current->next;
-    }
-    if(current_node->data.task_state == TASK_RUNNING) {
-        //printf("Schedule out task's PID\t:\t%d\n", current_node->data.pid);
-        current_node->data.task_state = TASK_READY;
-    }
-    if(current_node->next==NULL) {
-        current_node = head;
-    } else {
-        current_node = current_node->next;
-    }
-    getcontext(&scheduler_context);
-    scheduler_context.uc_stack.ss_sp = scheduler_stack;
-    scheduler_context.uc_stack.ss_size = STACK_SIZE;
-    scheduler_context.uc_stack.ss_flags = 0;
-    scheduler_context.uc_link = &mcontext;
-    makecontext(&scheduler_context, scheduler, 0);
+    set_timer(0);
+    //printf("Schedule out task's PID\t:\t%d\n", current_node->data.pid);
+    end_slice(SLICE_EXPIRED);
+    make_scheduler_context();
     setcontext(&scheduler_context);
 }
 
 /* Timer interrupt handler; makes the new signal function context, saves the running task and swaps to signal function */
 void timer_handler(int j)
 {
+    char here;
+    /* swapcontext unmasks the tick before it jumps to the task; a tick that
+      lands on the switching stack would save that frame as the task's context */
+    if(&here < current_node->data.stack
+       || &here >= current_node->data.stack + current_node->data.stack_size) {
+        set_timer(armed_quantum);
+        return;
+    }
+    if(preempt_count>0) { // In a critical section; switch at hw_preempt_enable
+        preempt_pending = 1;
+        return;
+    }
     getcontext(&signal_context);
     signal_context.uc_stack.ss_sp = signal_stack;
     signal_context.uc_stack.ss_size = STACK_SIZE;
@@ -346,82 +642,90 @@ void timer_handler(int j)
 
 void pause_handler(int sig)
 {
-    t.it_interval.tv_sec = 0;
-    t.it_interval.tv_usec = 0;
-    t.it_value = t.it_interval;
-    if (setitimer(ITIMER_REAL, &t, NULL) < 0) {
-        printf("settimer error.\n");
-        exit(1);
-    }
-    t_act.sa_handler = &timer_handler;
-    t_act.sa_flags = SA_RESTART | SA_SIGINFO;
-    sigfillset(&t_act.sa_mask);
-    if (sigaction(SIGALRM, &t_act, NULL) == -1) { // Intercept SIGALRM
-        perror("Error: cannot handle SIGALRM");
-        exit(1);
-    }
+    set_timer(0);
+    if(task_on_cpu) // Only a task on the CPU has time to charge
+        end_slice(SLICE_PAUSE);
     if(wait_exist) {
         remove_task(0);
         wait_exist = 0;
     }
-    struct Node *current = head;
-    while (current!=NULL) {
-        if(current!=current_node&&current->data.task_state == TASK_READY) {
-            current->data.queueing_time += current_node->data.time_quantum;
-        }
-        if(current->data.task_state == TASK_WAITING
-                && current->data.waiting_time > 0) {
-            current->data.waiting_time -= current_node->data.time_quantum;
-        }
-        if(current->data.task_state == TASK_WAITING
-                && current->data.waiting_time == 0) {
-            current->data.task_state = TASK_READY;
-        }
-        current = current->next;
-    }
 
     //printf(" Your input is Ctrl + Z\n");
     printf("\n");
 
     swapcontext(&scheduler_context, &mcontext);
-    getcontext(&scheduler_context);
-    scheduler_context.uc_stack.ss_sp = scheduler_stack;
-    scheduler_context.uc_stack.ss_size = STACK_SIZE;
-    scheduler_context.uc_stack.ss_flags = 0;
-    scheduler_context.uc_link = &mcontext;
-    makecontext(&scheduler_context, scheduler, 0);
+    make_scheduler_context();
     setcontext(&scheduler_context);
     swapcontext(&mcontext,&scheduler_context);
 }
 
 void hw_suspend(int msec_10)
 {
-    struct Node *current = head;
-    while (current!=NULL) {
-        if(current!=current_node&&current->data.task_state == TASK_READY) {
-            current->data.queueing_time += current_node->data.time_quantum;
-        }
-        if(current->data.task_state == TASK_WAITING
-                && current->data.waiting_time > 0) {
-            current->data.waiting_time -= current_node->data.time_quantum;
-        }
-        if(current->data.task_state == TASK_WAITING
-                && current->data.waiting_time == 0) {
-            current->data.task_state = TASK_READY;
-        }
-        current = current->next;
-    }
+    hw_suspend_us(msec_10 * 10000L);
+}
+
+/* Puts the running task to sleep for usec microseconds and reschedules; no
+  tick or pause may end the slice again before the switch */
+void hw_suspend_us(long usec)
+{
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    sigaddset(&block, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &block, &old);
+
     //printf("Suspend task's PID\t:\t%d\n", current_node->data.pid);
-    current_node->data.task_state = TASK_WAITING;
-    current_node->data.waiting_time = msec_10 * 10 ;
-    getcontext(&scheduler_context);
-    scheduler_context.uc_stack.ss_sp = scheduler_stack;
-    scheduler_context.uc_stack.ss_size = STACK_SIZE;
-    scheduler_context.uc_stack.ss_flags = 0;
-    scheduler_context.uc_link = &mcontext;
-    makecontext(&scheduler_context, scheduler, 0);
+    end_slice(SLICE_BLOCK);
+    current_node->data.waiting_time = usec;
+    make_scheduler_context();
     swapcontext(&current_node->data.context, &scheduler_context);
-    return;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Gives the CPU to the next ready task; switches to it directly instead of
+  through the timer signal and the scheduler context, and leaves the timer
+  alone when neither task is preemptive */
+static void yield_cpu(enum SLICE_END reason)
+{
+    sigset_t block, old;
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    sigaddset(&block, SIGTSTP);	// Either would end the slice a second time
+    sigprocmask(SIG_BLOCK, &block, &old);
+
+    struct Node *prev = current_node;
+    end_slice(reason);
+    struct Node *next = policy_op(pick_next)();
+    dispatch(next);
+    drop_stale_tick();
+    if(next!=prev) {
+        swapcontext(&prev->data.context, &next->data.context);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void hw_yield(void)
+{
+    yield_cpu(SLICE_YIELD);
+}
+
+/* Defers timer preemption of the running task until the matching hw_preempt_enable */
+void hw_preempt_disable(void)
+{
+    preempt_count++;
+}
+
+void hw_preempt_enable(void)
+{
+    if(--preempt_count==0&&preempt_pending) { // The deferred timer tick
+        yield_cpu(SLICE_EXPIRED);
+    }
+}
+
+/* CPU time used by the running task so far, in microseconds */
+long hw_task_runtime(void)
+{
+    return current_node->data.run_time + slice_elapsed();
 }
 
 void hw_wakeup_pid(int pid)
@@ -430,6 +734,7 @@ void hw_wakeup_pid(int pid)
     while (current!=NULL) {
         if(current->data.pid==pid&&current->data.task_state==TASK_WAITING) {
             current->data.task_state = TASK_READY;
+            policy_op(wake)(current);
         }
         current = current->next;
     }
@@ -444,6 +749,7 @@ int hw_wakeup_taskname(char *task_name)
         if(strcmp(current->data.task_name,task_name)==0
                 &&current->data.task_state==TASK_WAITING) {
             current->data.task_state = TASK_READY;
+            policy_op(wake)(current);
             num++;
         }
         current = current->next;
@@ -453,74 +759,142 @@ int hw_wakeup_taskname(char *task_name)
 
 int hw_task_create(char *task_name)
 {
-    void * stack;
-    getcontext(&newcontext);
-    stack = malloc(STACK_SIZE);
-    if (stack == NULL) {
-        perror("malloc");
-        exit(1);
-    }
-    newcontext.uc_stack.ss_sp = stack;
-    newcontext.uc_stack.ss_size = STACK_SIZE;
-    newcontext.uc_stack.ss_flags = 0;
-    newcontext.uc_link = &terminator_context;
-
-    int is_waiting = 0;
     /* setup the function we're going to. */
     if(strcmp(task_name,"task1")==0) {
-        makecontext(&newcontext, task1, 0);
-        //printf("context is %p\n", &newcontext);
+        return create_task(task_name, task1, pid_counter++, -1);
     } else if(strcmp(task_name,"task2")==0) {
-        makecontext(&newcontext, task2, 0);
-        //printf("context is %p\n", &newcontext);
+        return create_task(task_name, task2, pid_counter++, -1);
     } else if(strcmp(task_name,"task3")==0) {
-        makecontext(&newcontext, task3, 0);
-        //printf("context is %p\n", &newcontext);
+        return create_task(task_name, task3, pid_counter++, -1);
     } else if(strcmp(task_name,"task4")==0) {
-        makecontext(&newcontext, task4, 0);
-        //printf("context is %p\n", &newcontext);
+        return create_task(task_name, task4, pid_counter++, -1);
     } else if(strcmp(task_name,"task5")==0) {
-        makecontext(&newcontext, task5, 0);
-        //printf("context is %p\n", &newcontext);
+        return create_task(task_name, task5, pid_counter++, -1);
     } else if(strcmp(task_name,"task6")==0) {
-        makecontext(&newcontext, task6, 0);
-        //printf("context is %p\n", &newcontext);
+        return create_task(task_name, task6, pid_counter++, -1);
     } else if(strcmp(task_name,"waiting")==0) {
-        makecontext(&newcontext, waiting, 0);
-        //printf("context is %p\n", &newcontext);
-        is_waiting = 1;
-    } else {
-        return -1;
+        return create_task(task_name, waiting, 0, -1);
     }
+    return -1;
+}
+
+/* Makes the context of a new task running func and appends it to the task queue */
+static int create_task(char *task_name, void (*func)(void), int pid, int trace)
+{
+    char *stack;
+    size_t stack_size;
+    getcontext(&newcontext);
+    sigemptyset(&newcontext.uc_sigmask); // The creator may be a handler or a masked section
+    stack = stack_create(&stack_size);
+    newcontext.uc_stack.ss_sp = stack;
+    newcontext.uc_stack.ss_size = stack_size;
+    newcontext.uc_stack.ss_flags = 0;
+    newcontext.uc_link = &terminator_context;
+    makecontext(&newcontext, func, 0);
 
     struct Node *last = head;
     newNode = malloc(sizeof(struct Node));
-    strcpy(newNode->data.task_name, task_name);
+    snprintf(newNode->data.task_name, sizeof(newNode->data.task_name), "%s", task_name);
     newNode->data.context = newcontext;
-    if(is_waiting) {
-        newNode->data.pid=0;
-    } else {
-        newNode->data.pid=pid_counter++;
-    }
+    newNode->data.pid=pid;
     newNode->data.task_state=TASK_READY;
-    newNode->data.time_quantum=10;
+    newNode->data.time_quantum=QUANTUM_SHORT;
+    newNode->data.adaptive=0;
     newNode->data.queueing_time=0;
     newNode->data.waiting_time = 0;
     newNode->data.prior = 'L';
+    newNode->data.run_time = 0;
+    newNode->data.trace = trace;
+    newNode->data.stack = stack;
+    newNode->data.stack_size = stack_size;
+    newNode->data.stack_committed = TASK_STACK_INIT;
+    newNode->data.preempt_count = 0;
     newNode->next = NULL;
     if (head == NULL) {
         head = newNode;
-        current_node=head; /* Allocate the head to current node when head is builded */
-        return newNode->data.pid;
-    }
-    while (last->next != NULL) {
-        last = last->next;
+    } else {
+        while (last->next != NULL) {
+            last = last->next;
+        }
+        last->next = newNode;
     }
-    last->next = newNode;
+    policy_op(enqueue)(newNode);
     return newNode->data.pid;
 }
 
-void add_task(char *task_name, int time_quantum,char prior)
+/* Entry of a task replaying a trace entry on the real timer path */
+static void trace_entry(void)
+{
+    wl_run_task(&replay_wl, current_node->data.trace);
+}
+
+/* Replays a workload trace; "sim" compares policy models on a simulated clock,
+  "real" runs the trace through this scheduler with the given time quantum */
+static void replay(char *path, char *mode, char *quantum_spec)
+{
+    struct workload wl;
+    struct wl_metrics m;
+    long quantum;
+    int adaptive;
+
+    if(path[0]=='\0'||(strcmp(mode,"sim")!=0&&strcmp(mode,"real")!=0)
+       ||parse_quantum(quantum_spec, &quantum, &adaptive)<0) {
+        printf("usage: replay <file> [sim|real [L|S|A|C|<usec>]]\n");
+        return;
+    }
+    if(wl_load(&wl, path)<0)
+        return;
+    if(strcmp(mode,"sim")==0) {
+        wl_simulate(&wl);
+        wl_free(&wl);
+        return;
+    }
+    if(wl.ntasks>WL_REAL_MAX) {
+        printf("%d tasks are too many for the real timer path (max %d), use sim.\n",
+               wl.ntasks, WL_REAL_MAX);
+        wl_free(&wl);
+        return;
+    }
+
+    /* Tasks of the previous replay refer to the old trace */
+    struct Node *current = head;
+    while (current!=NULL) {
+        struct Node *next = current->next;
+        if(current->data.trace>=0)
+            remove_task(current->data.pid);
+        current = next;
+    }
+    wl_free(&replay_wl);
+    replay_wl = wl;
+    wl_reset(&replay_wl);
+
+    /* Every task sleeps until its arrival time */
+    for (int id = 0; id < replay_wl.ntasks; id++) {
+        struct wl_task *task = &replay_wl.tasks[id];
+        task->pid = create_task(task->type, trace_entry, pid_counter++, id);
+        newNode->data.time_quantum = quantum;
+        newNode->data.adaptive = adaptive;
+        if(task->arrival>0) {
+            newNode->data.task_state = TASK_WAITING;
+            newNode->data.waiting_time = task->arrival;
+        }
+    }
+
+    printf("simulating:...\n");
+    switch_count = 0;
+    replay_wl.epoch = now_us();
+    swapcontext(&mcontext, &scheduler_context);
+
+    for (current = head; current!=NULL; current = current->next) {
+        if(current->data.trace>=0)
+            replay_wl.tasks[current->data.trace].waited = current->data.queueing_time;
+    }
+    wl_collect(&replay_wl, switch_count, &m);
+    wl_print_header();
+    wl_print_metrics("real", &m);
+}
+
+void add_task(char *task_name, long time_quantum, int adaptive, char prior)
 {
     //printf("Added task:\n");
     //printf("task name: %s\n", task_name);
@@ -531,24 +905,14 @@ void add_task(char *task_name, int time_quantum,char prior)
         return;
     }
     newNode->data.time_quantum=time_quantum;
+    newNode->data.adaptive=adaptive;
     newNode->data.prior=prior;
     return;
 }
 void remove_task(int pid)
 {
     struct Node *current = head;
-    struct Node *prev;
-    /* If head node itself holds the pid to be deleted */
-    if (current != NULL && current->data.pid == pid) {
-        if(current_node==head) {
-            head = current->next;
-            current_node = head;
-        } else {
-            head = current->next;
-        }
-        free(current);
-        return;
-    }
+    struct Node *prev = NULL;
 
     /* Search for the pid to be deleted, keep track of the previous node as we need to change 'prev->next' */
     while (current != NULL && current->data.pid != pid) {
@@ -563,16 +927,13 @@ void remove_task(int pid)
     }
 
     /* Unlink the node from linked list */
-    if(current_node==current) {
-        prev->next = current->next;
-        if(current->next==NULL) {
-            current_node = head;
-        } else {
-            current_node = current->next;
-        }
+    policy_op(dequeue)(current);
+    if (prev == NULL) {
+        head = current->next;
     } else {
         prev->next = current->next;
     }
+    stack_destroy(current);
     free(current);
     return;
 }
@@ -604,12 +965,20 @@ void process_status()
         default:
             ;
         }
-        char c;
-        if(current->data.time_quantum==20)
-            c='L';
-        else c='S';
-        printf("%d\t%s\t%s\t%d\t%c\t%c\n", current->data.pid, current->data.task_name,
-               state, current->data.queueing_time,current->data.prior,c);
+        char quantum[32];
+        if(current->data.adaptive)
+            snprintf(quantum, sizeof(quantum), "A(%ldus)", current->data.time_quantum);
+        else if(current->data.time_quantum==0)
+            strcpy(quantum, "C");
+        else if(current->data.time_quantum==QUANTUM_LONG)
+            strcpy(quantum, "L");
+        else if(current->data.time_quantum==QUANTUM_SHORT)
+            strcpy(quantum, "S");
+        else
+            snprintf(quantum, sizeof(quantum), "%ldus", current->data.time_quantum);
+        printf("%d\t%s\t%s\t%ld\t%c\t%s\t%zuK\n", current->data.pid, current->data.task_name,
+               state, current->data.queueing_time / 1000,current->data.prior,quantum,
+               (stack_high_water(current) + 1023) / 1024);
         current = current->next;
     }
 }
@@ -620,6 +989,7 @@ void free_all()
     struct Node* next;
     while (current != NULL) {
         next = current->next;
+        stack_destroy(current);
         free(current);
         current = next;
     }
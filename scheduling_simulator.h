@@ -9,7 +9,10 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <time.h>
 #include "task.h"
+#include "sched_policy.h"
 
 enum TASK_STATE {
     TASK_RUNNING,
@@ -19,9 +22,15 @@ enum TASK_STATE {
 };
 
 void hw_suspend(int msec_10);
+void hw_suspend_us(long usec);
+void hw_yield(void);
+void hw_preempt_disable(void);
+void hw_preempt_enable(void);
+long hw_task_runtime(void);
 void hw_wakeup_pid(int pid);
 int hw_wakeup_taskname(char *task_name);
 int hw_task_create(char *task_name);
+long long now_us(void);
 void scheduler(void);
 void waiting(void);
 void terminator(void);
@@ -38,7 +47,7 @@ void task3(void);
 void task4(void);
 void task5(void);
 void task6(void);
-void add_task(char *task_name, int time_quantum,char prior);
+void add_task(char *task_name, long time_quantum, int adaptive, char prior);
 void remove_task(int pid);
 void start_simulation(void);
 void process_status(void);
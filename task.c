@@ -23,42 +23,56 @@ void task3(void) // wait infinite
 {
 	//printf("running_pid:%d\n",running_pid);
 	hw_suspend(32768);
+	hw_preempt_disable();
 	fprintf(stdout, "task3: good morning~\n");
 	fflush(stdout);
+	hw_preempt_enable();
 }
 
 void task4(void) // sleep 5s
 {
+	hw_preempt_disable();
 	printf("hello\n");
+	hw_preempt_enable();
 	hw_suspend(500);
+	hw_preempt_disable();
 	fprintf(stdout, "task4: good morning~\n");
 	fflush(stdout);
+	hw_preempt_enable();
 }
 
 void task5(void)
 {
+	hw_preempt_disable();
 	int pid = hw_task_create("task3");
+	hw_preempt_enable();
 
 	hw_suspend(1000);
+	hw_preempt_disable();
 	fprintf(stdout, "task5: good morning~\n");
 	fflush(stdout);
 
 	hw_wakeup_pid(pid);
 	fprintf(stdout, "Mom(task5): wake up pid %d~\n", pid);
 	fflush(stdout);
+	hw_preempt_enable();
 }
 
 void task6(void)
 {
+	hw_preempt_disable();
 	for (int num = 0; num < 5; ++num) {
 		hw_task_create("task3");
 	}
+	hw_preempt_enable();
 
 	hw_suspend(1000);
+	hw_preempt_disable();
 	fprintf(stdout, "task6: good morning~\n");
 	fflush(stdout);
 
 	int num_wake_up = hw_wakeup_taskname("task3");
 	fprintf(stdout, "Mom(task6): wake up task3=%d~\n", num_wake_up);
 	fflush(stdout);
+	hw_preempt_enable();
 }
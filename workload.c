@@ -0,0 +1,565 @@
+#include <math.h>
+#include <limits.h>
+#include "workload.h"
+
+#define WL_GEN_CPU_SHARE 0.3	/* Share of CPU bound tasks in generated traces */
+#define WL_GEN_DEP_SHARE 0.05	/* Share of generated tasks waiting on an earlier one */
+#define WL_DELIM " \t\r\n"
+
+/* Min-heap of pending wakeups (arrival, sleep end, dependency) on the simulated clock */
+struct wl_event {
+    long long time;
+    int id;
+};
+
+struct wl_heap {
+    struct wl_event *ev;
+    int n;
+};
+
+/* State of one run over a trace on the simulated clock */
+struct wl_sim {
+    struct workload *wl;
+    struct wl_heap heap;
+    int *ready;				/* FIFO ring of ready task ids */
+    int ready_head;
+    int ready_count;
+    long long now;
+    int adaptive;
+};
+
+/* Models of the scheduler's policies on the simulated clock; they do not go
+  through struct sched_policy, so a new policy needs a model here as well
+  before replay can compare it in sim mode */
+static const struct {
+    const char *name;
+    long quantum;			/* 0 runs every burst to completion */
+    int adaptive;
+} wl_policies[] = {
+    { "sim-RR-S", QUANTUM_SHORT, 0 },
+    { "sim-RR-L", QUANTUM_LONG, 0 },
+    { "sim-RR-A", QUANTUM_SHORT, 1 },
+    { "sim-FCFS", 0, 0 },
+};
+
+static struct wl_task *wl_add_task(struct workload *wl)
+{
+    if (wl->ntasks == wl->task_cap) {
+        int cap = wl->task_cap ? wl->task_cap * 2 : 256;
+        struct wl_task *tasks = realloc(wl->tasks, (size_t)cap * sizeof(*tasks));
+        if (tasks == NULL)
+            return NULL;
+        wl->tasks = tasks;
+        wl->task_cap = cap;
+    }
+    memset(&wl->tasks[wl->ntasks], 0, sizeof(struct wl_task));
+    return &wl->tasks[wl->ntasks++];
+}
+
+static int wl_add_op(struct workload *wl, enum WL_OP type, long arg)
+{
+    if (wl->nops == wl->op_cap) {
+        int cap = wl->op_cap ? wl->op_cap * 2 : 1024;
+        struct wl_op *ops = realloc(wl->ops, (size_t)cap * sizeof(*ops));
+        if (ops == NULL)
+            return -1;
+        wl->ops = ops;
+        wl->op_cap = cap;
+    }
+    wl->ops[wl->nops].type = type;
+    wl->ops[wl->nops].arg = arg;
+    wl->nops++;
+    return 0;
+}
+
+/* Rejects traces whose wait edges form a cycle, none of those tasks could ever
+  finish; iterative DFS so that long dependency chains cannot overflow the stack */
+static int wl_check_cycles(struct workload *wl, const char *path)
+{
+    if (wl->ntasks <= 0)
+        return 0;
+
+    size_t n = wl->ntasks;
+    char *color = calloc(n, 1);	/* 0 unvisited, 1 on the path, 2 done */
+    int *next_op = calloc(n, sizeof(int));
+    int *path_ids = malloc(n * sizeof(int));
+    int ret = 0;
+
+    if (color == NULL || next_op == NULL || path_ids == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+    for (int root = 0; root < wl->ntasks && ret == 0; root++) {
+        int depth = 0;
+        if (color[root])
+            continue;
+        color[root] = 1;
+        path_ids[depth++] = root;
+        while (depth > 0 && ret == 0) {
+            int id = path_ids[depth - 1];
+            struct wl_task *task = &wl->tasks[id];
+            if (next_op[id] == task->nops) {
+                color[id] = 2;
+                depth--;
+                continue;
+            }
+            struct wl_op *op = &wl->ops[task->first_op + next_op[id]++];
+            if (op->type != WL_WAIT)
+                continue;
+            if (color[op->arg] == 1) {
+                fprintf(stderr, "%s: dependency cycle through tasks %d and %ld\n",
+                        path, id, op->arg);
+                ret = -1;
+            } else if (color[op->arg] == 0) {
+                color[op->arg] = 1;
+                path_ids[depth++] = op->arg;
+            }
+        }
+    }
+    free(color);
+    free(next_op);
+    free(path_ids);
+    return ret;
+}
+
+/* Parses a trace file; returns 0 on success, -1 after reporting the error */
+int wl_load(struct workload *wl, const char *path)
+{
+    char line[4096];
+    int lineno = 0;
+    FILE *fp = fopen(path, "r");
+
+    memset(wl, 0, sizeof(*wl));
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        lineno++;
+        char *hash = strchr(line, '#');
+        if (hash != NULL)
+            *hash = '\0';
+        char *tok = strtok(line, WL_DELIM);
+        if (tok == NULL)
+            continue;
+
+        struct wl_task *task = wl_add_task(wl);
+        if (task == NULL) {
+            perror("realloc");
+            goto fail;
+        }
+        char *end;
+        task->arrival = strtoll(tok, &end, 10);
+        if (*end != '\0' || task->arrival < 0) {
+            fprintf(stderr, "%s:%d: bad arrival time '%s'\n", path, lineno, tok);
+            goto fail;
+        }
+        tok = strtok(NULL, WL_DELIM);
+        if (tok == NULL) {
+            fprintf(stderr, "%s:%d: missing task type\n", path, lineno);
+            goto fail;
+        }
+        snprintf(task->type, sizeof(task->type), "%s", tok);
+
+        task->first_op = wl->nops;
+        while ((tok = strtok(NULL, WL_DELIM)) != NULL) {
+            enum WL_OP type = WL_RUN;
+            long arg = strtol(tok + 1, &end, 10);
+            if (tok[0] == 'r') {
+                type = WL_RUN;
+            } else if (tok[0] == 's') {
+                type = WL_SLEEP;
+            } else if (tok[0] == 'w') {
+                type = WL_WAIT;
+            } else {
+                end = tok;
+            }
+            if (end == tok + 1 || *end != '\0' || arg < 0) {
+                fprintf(stderr, "%s:%d: bad op '%s'\n", path, lineno, tok);
+                goto fail;
+            }
+            if (type == WL_RUN && arg == 0)
+                continue;
+            /* Back to back bursts are a single burst */
+            if (type == WL_RUN && wl->nops > task->first_op
+                    && wl->ops[wl->nops - 1].type == WL_RUN) {
+                wl->ops[wl->nops - 1].arg += arg;
+                continue;
+            }
+            if (wl_add_op(wl, type, arg) < 0) {
+                perror("realloc");
+                goto fail;
+            }
+        }
+        task->nops = wl->nops - task->first_op;
+    }
+    fclose(fp);
+
+    /* Dependencies can only be checked once every task is known */
+    for (int id = 0; id < wl->ntasks; id++) {
+        struct wl_task *task = &wl->tasks[id];
+        for (int i = 0; i < task->nops; i++) {
+            struct wl_op *op = &wl->ops[task->first_op + i];
+            if (op->type == WL_WAIT && (op->arg >= wl->ntasks || op->arg == id)) {
+                fprintf(stderr, "%s: task %d waits on invalid task %ld\n", path, id, op->arg);
+                wl_free(wl);
+                return -1;
+            }
+        }
+    }
+    if (wl_check_cycles(wl, path) < 0) {
+        wl_free(wl);
+        return -1;
+    }
+    return 0;
+
+fail:
+    fclose(fp);
+    wl_free(wl);
+    return -1;
+}
+
+static double wl_exp(double mean)
+{
+    return -mean * log(1.0 - drand48());
+}
+
+/* Heavy-tailed burst length, capped so a single task cannot dominate a run */
+static long wl_pareto(double xm, double alpha, long cap)
+{
+    double x = xm / pow(1.0 - drand48(), 1.0 / alpha);
+    return x > cap ? cap : (long)x;
+}
+
+/* Writes a synthetic trace of ntasks tasks with Poisson arrivals; interactive
+  tasks alternate short heavy-tailed bursts with sleeps, CPU bound ones run
+  one or two long heavy-tailed bursts */
+int wl_generate(const char *path, int ntasks, long mean_interarrival, unsigned int seed)
+{
+    double arrival = 0;
+    FILE *fp = fopen(path, "w");
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    srand48(seed);
+    fprintf(fp, "# %d tasks, mean inter-arrival %ld us, seed %u\n",
+            ntasks, mean_interarrival, seed);
+    for (int id = 0; id < ntasks; id++) {
+        int cpu = drand48() < WL_GEN_CPU_SHARE;
+        int bursts = cpu ? 1 + (drand48() < 0.5) : 2 + (int)(drand48() * 5);
+
+        arrival += wl_exp(mean_interarrival);
+        fprintf(fp, "%lld %s", (long long)arrival, cpu ? "cpu" : "io");
+        if (id > 0 && drand48() < WL_GEN_DEP_SHARE)
+            fprintf(fp, " w%d", (int)(drand48() * id));
+        for (int i = 0; i < bursts; i++) {
+            if (i > 0)
+                fprintf(fp, " s%ld", (long)wl_exp(cpu ? 2000 : 5000));
+            if (cpu)
+                fprintf(fp, " r%ld", wl_pareto(5000, 1.2, 2000000));
+            else
+                fprintf(fp, " r%ld", wl_pareto(200, 1.5, 50000));
+        }
+        fputc('\n', fp);
+    }
+    if (fclose(fp) != 0) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+/* Clears the replay state of every task */
+void wl_reset(struct workload *wl)
+{
+    for (int id = 0; id < wl->ntasks; id++) {
+        struct wl_task *task = &wl->tasks[id];
+        task->pc = 0;
+        task->remain = 0;
+        task->done = 0;
+        task->waiters = -1;
+        task->next_waiter = -1;
+        task->pid = 0;
+        task->ready_since = 0;
+        task->first_run = -1;
+        task->finish = 0;
+        task->waited = 0;
+    }
+}
+
+static void wl_heap_push(struct wl_heap *h, long long time, int id)
+{
+    int i = h->n++;
+    while (i > 0 && h->ev[(i - 1) / 2].time > time) {
+        h->ev[i] = h->ev[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    h->ev[i].time = time;
+    h->ev[i].id = id;
+}
+
+static struct wl_event wl_heap_pop(struct wl_heap *h)
+{
+    struct wl_event top = h->ev[0];
+    struct wl_event last = h->ev[--h->n];
+    int i = 0;
+
+    while (2 * i + 1 < h->n) {
+        int child = 2 * i + 1;
+        if (child + 1 < h->n && h->ev[child + 1].time < h->ev[child].time)
+            child++;
+        if (last.time <= h->ev[child].time)
+            break;
+        h->ev[i] = h->ev[child];
+        i = child;
+    }
+    h->ev[i] = last;
+    return top;
+}
+
+static void wl_sim_ready(struct wl_sim *sim, int id)
+{
+    int n = sim->wl->ntasks;
+    sim->wl->tasks[id].ready_since = sim->now;
+    sim->ready[(sim->ready_head + sim->ready_count++) % n] = id;
+}
+
+static void wl_sim_adapt(struct wl_sim *sim, struct wl_task *task, int used_full)
+{
+    if (sim->adaptive)
+        task->quantum = next_quantum(task->quantum, used_full);
+}
+
+/* Executes the ops of a task from its pc until it needs the CPU, blocks or
+  terminates; ran tells whether the task is coming straight off the CPU */
+static void wl_sim_step(struct wl_sim *sim, int id, int ran)
+{
+    struct workload *wl = sim->wl;
+    struct wl_task *task = &wl->tasks[id];
+
+    while (task->pc < task->nops) {
+        struct wl_op *op = &wl->ops[task->first_op + task->pc++];
+        struct wl_task *target;
+
+        switch (op->type) {
+        case WL_RUN:
+            task->remain = op->arg;
+            wl_sim_ready(sim, id);
+            return;
+        case WL_SLEEP:
+            if (ran)
+                wl_sim_adapt(sim, task, 0);
+            wl_heap_push(&sim->heap, sim->now + op->arg, id);
+            return;
+        case WL_WAIT:
+            target = &wl->tasks[op->arg];
+            if (target->done)
+                break;
+            if (ran)
+                wl_sim_adapt(sim, task, 0);
+            task->next_waiter = target->waiters;
+            target->waiters = id;
+            return;
+        }
+    }
+    task->done = 1;
+    task->finish = sim->now;
+    for (int w = task->waiters; w >= 0; w = wl->tasks[w].next_waiter)
+        wl_heap_push(&sim->heap, sim->now, w);
+}
+
+static void wl_sim_wakeups(struct wl_sim *sim)
+{
+    while (sim->heap.n > 0 && sim->heap.ev[0].time <= sim->now) {
+        struct wl_event ev = wl_heap_pop(&sim->heap);
+        wl_sim_step(sim, ev.id, 0);
+    }
+}
+
+/* Runs the whole trace on the simulated clock under one round-robin policy */
+static void wl_sim_run(struct workload *wl, long quantum, int adaptive, struct wl_metrics *m)
+{
+    struct wl_sim sim;
+    long long switches = 0;
+    int last = -1;
+
+    memset(&sim, 0, sizeof(sim));
+    sim.wl = wl;
+    sim.adaptive = adaptive;
+    sim.ready = malloc((size_t)wl->ntasks * sizeof(int));
+    sim.heap.ev = malloc((size_t)wl->ntasks * sizeof(struct wl_event));
+    if (sim.ready == NULL || sim.heap.ev == NULL) {
+        perror("malloc");
+        exit(1);
+    }
+
+    wl_reset(wl);
+    for (int id = 0; id < wl->ntasks; id++) {
+        wl->tasks[id].quantum = quantum;
+        wl_heap_push(&sim.heap, wl->tasks[id].arrival, id);
+    }
+
+    while (1) {
+        wl_sim_wakeups(&sim);
+        if (sim.ready_count == 0) {
+            if (sim.heap.n == 0)
+                break;
+            sim.now = sim.heap.ev[0].time;
+            continue;
+        }
+
+        int id = sim.ready[sim.ready_head];
+        struct wl_task *task = &wl->tasks[id];
+        sim.ready_head = (sim.ready_head + 1) % wl->ntasks;
+        sim.ready_count--;
+
+        task->waited += sim.now - task->ready_since;
+        if (task->first_run < 0)
+            task->first_run = sim.now;
+        if (id != last) {
+            sim.now += WL_SWITCH_US;
+            switches++;
+            last = id;
+        }
+
+        long slice = task->remain;
+        if (task->quantum > 0 && slice > task->quantum)
+            slice = task->quantum;
+        sim.now += slice;
+        task->remain -= slice;
+
+        if (task->remain > 0) {
+            wl_sim_adapt(&sim, task, 1);
+            /* Tasks woken during the slice queue ahead of the preempted one */
+            wl_sim_wakeups(&sim);
+            wl_sim_ready(&sim, id);
+        } else {
+            wl_sim_step(&sim, id, 1);
+        }
+    }
+
+    wl_collect(wl, switches, m);
+    free(sim.ready);
+    free(sim.heap.ev);
+}
+
+/* Replays the trace on the simulated clock once per policy model and prints a comparison */
+void wl_simulate(struct workload *wl)
+{
+    struct wl_metrics m;
+
+    if (wl->ntasks == 0) {
+        printf("No task in the trace.\n");
+        return;
+    }
+    wl_print_header();
+    for (int i = 0; i < sizeof(wl_policies) / sizeof(wl_policies[0]); i++) {
+        wl_sim_run(wl, wl_policies[i].quantum, wl_policies[i].adaptive, &m);
+        wl_print_metrics(wl_policies[i].name, &m);
+    }
+}
+
+/* Body of a replayed task on the real timer path; times are relative to wl->epoch */
+void wl_run_task(struct workload *wl, int id)
+{
+    struct wl_task *task = &wl->tasks[id];
+    sigset_t block, old;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGALRM);
+    sigaddset(&block, SIGTSTP);
+    for (int pc = 0; pc < task->nops; pc++) {
+        struct wl_op *op = &wl->ops[task->first_op + pc];
+        struct wl_task *target;
+        long burst_end;
+
+        switch (op->type) {
+        case WL_RUN:
+            if (task->first_run < 0)
+                task->first_run = now_us() - wl->epoch;
+            burst_end = hw_task_runtime() + op->arg;
+            while (hw_task_runtime() < burst_end)
+                ;
+            break;
+        case WL_SLEEP:
+            hw_suspend_us(op->arg);
+            break;
+        case WL_WAIT:
+            target = &wl->tasks[op->arg];
+            /* No tick between the check and joining the waiter list, or target
+              could finish in between and never wake us; hw_suspend_us keeps
+              the rest of the way to sleep masked */
+            sigprocmask(SIG_BLOCK, &block, &old);
+            if (!target->done) {
+                task->next_waiter = target->waiters;
+                target->waiters = id;
+                hw_suspend_us(LONG_MAX);
+            }
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            break;
+        }
+    }
+    task->done = 1;
+    task->finish = now_us() - wl->epoch;
+    for (int w = task->waiters; w >= 0; w = wl->tasks[w].next_waiter)
+        hw_wakeup_pid(wl->tasks[w].pid);
+}
+
+/* Computes throughput, turnaround, waiting and response time over the replayed tasks */
+void wl_collect(struct workload *wl, long long switches, struct wl_metrics *m)
+{
+    long long first_arrival = LLONG_MAX, last_finish = 0;
+    int responded = 0;
+
+    memset(m, 0, sizeof(*m));
+    m->switches = switches;
+    for (int id = 0; id < wl->ntasks; id++) {
+        struct wl_task *task = &wl->tasks[id];
+        if (task->arrival < first_arrival)
+            first_arrival = task->arrival;
+        if (!task->done) {
+            m->unfinished++;
+            continue;
+        }
+        m->finished++;
+        if (task->finish > last_finish)
+            last_finish = task->finish;
+        m->turnaround += task->finish - task->arrival;
+        m->waiting += task->waited;
+        if (task->first_run >= 0) {	/* Tasks without a CPU burst have no response time */
+            m->response += task->first_run - task->arrival;
+            responded++;
+        }
+    }
+    if (m->finished > 0) {
+        m->makespan = last_finish - first_arrival;
+        m->turnaround /= m->finished;
+        m->waiting /= m->finished;
+        if (responded > 0)
+            m->response /= responded;
+    }
+}
+
+void wl_print_header(void)
+{
+    printf("%-8s %9s %9s %12s %10s %14s %12s %12s %10s\n", "policy", "done", "blocked",
+           "makespan_ms", "tput/s", "turnaround_ms", "waiting_ms", "response_ms", "switches");
+}
+
+void wl_print_metrics(const char *policy, struct wl_metrics *m)
+{
+    double throughput = m->makespan > 0 ? m->finished * 1e6 / m->makespan : 0;
+
+    printf("%-8s %9d %9d %12.1f %10.1f %14.3f %12.3f %12.3f %10lld\n", policy,
+           m->finished, m->unfinished, m->makespan / 1000.0, throughput,
+           m->turnaround / 1000, m->waiting / 1000, m->response / 1000, m->switches);
+}
+
+void wl_free(struct workload *wl)
+{
+    free(wl->tasks);
+    free(wl->ops);
+    memset(wl, 0, sizeof(*wl));
+}
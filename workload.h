@@ -0,0 +1,92 @@
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sched_policy.h"
+
+/*
+ * Workload trace format; one task per line, '#' starts a comment:
+ *
+ *     <arrival_us> <type> <op> [<op> ...]
+ *
+ * where every op is one of
+ *     r<us>    CPU burst of <us> microseconds
+ *     s<us>    sleep for <us> microseconds
+ *     w<id>    block until task <id> (0-based line index) has terminated
+ */
+
+#define WL_SWITCH_US 5		/* Context switch cost charged by the simulated clock */
+#define WL_REAL_MAX 4096	/* Largest trace replayed through the real timer path */
+#define WL_GEN_INTERARRIVAL 15000	/* Default mean inter-arrival time of generated traces */
+
+enum WL_OP {
+    WL_RUN,
+    WL_SLEEP,
+    WL_WAIT
+};
+
+struct wl_op {
+    enum WL_OP type;
+    long arg;
+};
+
+struct wl_task {
+    long long arrival;		/* Arrival time in microseconds from trace start */
+    char type[10];
+    int first_op;			/* Index of the first op in workload.ops */
+    int nops;
+
+    /* Replay state */
+    int pc;					/* Next op to execute */
+    long remain;			/* Microseconds left in the current CPU burst */
+    long quantum;			/* Adaptive quantum (simulated clock) */
+    int done;
+    int waiters;			/* Head of the list of tasks waiting on this one */
+    int next_waiter;
+    int pid;				/* Scheduler pid (real timer path) */
+    long long ready_since;
+    long long first_run;	/* Start of the first CPU burst, -1 until then */
+    long long finish;
+    long long waited;		/* Microseconds spent ready but not running */
+};
+
+struct workload {
+    struct wl_task *tasks;
+    int ntasks;
+    int task_cap;
+    struct wl_op *ops;
+    int nops;
+    int op_cap;
+    long long epoch;		/* Replay start on the real timer path */
+};
+
+struct wl_metrics {
+    int finished;
+    int unfinished;
+    long long makespan;
+    double turnaround;
+    double waiting;
+    double response;
+    long long switches;
+};
+
+/* Scheduler calls made by replayed tasks */
+long long now_us(void);
+void hw_suspend_us(long usec);
+long hw_task_runtime(void);
+void hw_wakeup_pid(int pid);
+
+int wl_load(struct workload *wl, const char *path);
+int wl_generate(const char *path, int ntasks, long mean_interarrival, unsigned int seed);
+void wl_reset(struct workload *wl);
+void wl_simulate(struct workload *wl);
+void wl_run_task(struct workload *wl, int id);
+void wl_collect(struct workload *wl, long long switches, struct wl_metrics *m);
+void wl_print_header(void);
+void wl_print_metrics(const char *policy, struct wl_metrics *m);
+void wl_free(struct workload *wl);
+
+#endif